@@ -20,74 +20,292 @@
 #ifndef __ADVANCED_PAGE_H_INCLUDED__
 #define __ADVANCED_PAGE_H_INCLUDED__
 
+#include "plugin-trace.h"
+
+/*
+ * The widgets of an advanced dialog whose values are restored on Cancel,
+ * found once when the dialog is built. Snapshot and restore are a linear
+ * pass over the array, strings are only reallocated when they changed.
+ */
+
+enum _AdvancedSettingKind
+{
+  ADVANCED_SETTING_INT,
+  ADVANCED_SETTING_STRING,
+  ADVANCED_SETTING_BOOL
+};
+
+typedef enum _AdvancedSettingKind AdvancedSettingKind;
+
+struct _AdvancedSetting
+{
+  GtkWidget *widget;
+  /* account parameter of a RtcomParam* widget, NULL otherwise */
+  gchar *field;
+  AdvancedSettingKind kind;
+  /* set by set_advanced_settings() */
+  gboolean changed;
+  union
+  {
+    gint i;
+    gboolean b;
+    gchar *s;
+  } value;
+};
+
+typedef struct _AdvancedSetting AdvancedSetting;
+
 static void
-set_widget_setting (gpointer key, gpointer value, gpointer userdata)
+find_advanced_settings(GtkWidget *widget, GArray *settings)
 {
-  GtkWidget *widget = key;
+  AdvancedSetting setting = { widget, NULL, ADVANCED_SETTING_INT, FALSE,
+                              { 0 } };
 
   if (RTCOM_IS_PARAM_INT(widget))
-  {
-    rtcom_param_int_set_value(RTCOM_PARAM_INT(widget),
-                              GPOINTER_TO_INT(value));
-  }
+    setting.kind = ADVANCED_SETTING_INT;
   else if (GTK_IS_ENTRY(widget))
-    gtk_entry_set_text(GTK_ENTRY(widget), value);
+    setting.kind = ADVANCED_SETTING_STRING;
   else if (HILDON_IS_CHECK_BUTTON(widget))
+    setting.kind = ADVANCED_SETTING_BOOL;
+  else
   {
-    hildon_check_button_set_active(HILDON_CHECK_BUTTON(widget),
-                                   GPOINTER_TO_INT(value));
+    if (GTK_IS_CONTAINER(widget))
+    {
+      gtk_container_foreach(GTK_CONTAINER(widget),
+                            (GtkCallback)find_advanced_settings, settings);
+    }
+    else if (!GTK_IS_LABEL(widget))
+    {
+      g_warning("%s: unhandled widget type %s (%s)", G_STRFUNC,
+                g_type_name(G_TYPE_FROM_INSTANCE(widget)),
+                gtk_widget_get_name(widget));
+    }
+
+    return;
   }
-  else
+
+  if (g_object_class_find_property(G_OBJECT_GET_CLASS(widget), "field"))
+    g_object_get(widget, "field", &setting.field, NULL);
+
+  g_array_append_val(settings, setting);
+}
+
+static void
+get_advanced_settings(GArray *settings)
+{
+  guint i;
+
+  for (i = 0; i < settings->len; i++)
   {
-    g_warning("%s: unhandled widget type %s (%s)", G_STRFUNC,
-              g_type_name(G_TYPE_FROM_INSTANCE(widget)),
-              gtk_widget_get_name(widget));
+    AdvancedSetting *setting = &g_array_index(settings, AdvancedSetting, i);
+
+    switch (setting->kind)
+    {
+      case ADVANCED_SETTING_INT:
+      {
+        setting->value.i =
+            rtcom_param_int_get_value(RTCOM_PARAM_INT(setting->widget));
+        break;
+      }
+      case ADVANCED_SETTING_STRING:
+      {
+        const gchar *text = gtk_entry_get_text(GTK_ENTRY(setting->widget));
+
+        if (g_strcmp0(text, setting->value.s))
+        {
+          g_free(setting->value.s);
+          setting->value.s = g_strdup(text);
+        }
+
+        break;
+      }
+      case ADVANCED_SETTING_BOOL:
+      {
+        setting->value.b = hildon_check_button_get_active(
+            HILDON_CHECK_BUTTON(setting->widget));
+        break;
+      }
+    }
   }
 }
 
+/*
+ * Handlers that update other widgets (visibility, default ports) when a
+ * settings widget changes. On Cancel they are blocked while the values are
+ * restored and then run once for every widget that actually changed.
+ */
+struct _AdvancedDependent
+{
+  GtkWidget *widget;
+  GCallback callback;
+  gpointer user_data;
+};
+
+typedef struct _AdvancedDependent AdvancedDependent;
+
 static void
-get_advanced_settings (GtkWidget *widget, GHashTable *advanced_settings)
+advanced_settings_add_dependent(GtkWidget *dialog, GtkWidget *widget,
+                                GCallback callback, gpointer user_data)
 {
-  const gchar *name = gtk_widget_get_name(widget);
+  GArray *dependents = g_object_get_data(G_OBJECT(dialog), "dependents");
+  AdvancedDependent dependent = { widget, callback, user_data };
 
-  if (RTCOM_IS_PARAM_INT(widget))
+  if (!dependents)
   {
-    gint value = rtcom_param_int_get_value(RTCOM_PARAM_INT(widget));
-    g_hash_table_replace(advanced_settings, widget,
-                         GINT_TO_POINTER(value));
+    dependents = g_array_new(FALSE, FALSE, sizeof(AdvancedDependent));
+    g_object_set_data_full(G_OBJECT(dialog), "dependents", dependents,
+                           (GDestroyNotify)g_array_unref);
   }
-  else if (GTK_IS_ENTRY(widget))
+
+  g_array_append_val(dependents, dependent);
+}
+
+static void
+block_dependents(GArray *dependents, GtkWidget *widget, gboolean block)
+{
+  guint i;
+
+  for (i = 0; dependents && i < dependents->len; i++)
+  {
+    AdvancedDependent *dep = &g_array_index(dependents, AdvancedDependent, i);
+
+    if (dep->widget != widget)
+      continue;
+
+    if (block)
+    {
+      g_signal_handlers_block_matched(widget, G_SIGNAL_MATCH_FUNC, 0, 0,
+                                      NULL, dep->callback, NULL);
+    }
+    else
+    {
+      g_signal_handlers_unblock_matched(widget, G_SIGNAL_MATCH_FUNC, 0, 0,
+                                        NULL, dep->callback, NULL);
+    }
+  }
+}
+
+static gboolean
+set_advanced_setting(AdvancedSetting *setting)
+{
+  switch (setting->kind)
   {
-    gchar *data = g_strdup(gtk_entry_get_text(GTK_ENTRY(widget)));
-    g_object_set_data_full(G_OBJECT(widget), "adv_data", data, g_free);
-    g_hash_table_replace(advanced_settings, widget, data);
+    case ADVANCED_SETTING_INT:
+    {
+      RtcomParamInt *param = RTCOM_PARAM_INT(setting->widget);
+
+      if (rtcom_param_int_get_value(param) == setting->value.i)
+        return FALSE;
+
+      rtcom_param_int_set_value(param, setting->value.i);
+      break;
+    }
+    case ADVANCED_SETTING_STRING:
+    {
+      const gchar *text = setting->value.s ? setting->value.s : "";
+
+      if (!strcmp(gtk_entry_get_text(GTK_ENTRY(setting->widget)), text))
+        return FALSE;
+
+      gtk_entry_set_text(GTK_ENTRY(setting->widget), text);
+      break;
+    }
+    case ADVANCED_SETTING_BOOL:
+    {
+      HildonCheckButton *button = HILDON_CHECK_BUTTON(setting->widget);
+
+      if (!hildon_check_button_get_active(button) == !setting->value.b)
+        return FALSE;
+
+      hildon_check_button_set_active(button, setting->value.b);
+      break;
+    }
   }
-  else if (HILDON_IS_CHECK_BUTTON(widget))
+
+  return TRUE;
+}
+
+static void
+apply_advanced_settings(GArray *dependents, GArray *settings)
+{
+  guint i;
+
+  for (i = 0; i < settings->len; i++)
   {
-    gboolean active =
-        hildon_check_button_get_active(HILDON_CHECK_BUTTON(widget));
+    AdvancedSetting *setting = &g_array_index(settings, AdvancedSetting, i);
 
-    g_hash_table_replace(advanced_settings, widget, GINT_TO_POINTER(active));
+    block_dependents(dependents, setting->widget, TRUE);
+    setting->changed = set_advanced_setting(setting);
+    block_dependents(dependents, setting->widget, FALSE);
   }
-  else if (GTK_IS_CONTAINER(widget))
+}
+
+static void
+set_advanced_settings(GtkWidget *dialog, GArray *settings)
+{
+  GArray *dependents = g_object_get_data(G_OBJECT(dialog), "dependents");
+  guint i;
+
+  apply_advanced_settings(dependents, settings);
+
+  for (i = 0; dependents && i < dependents->len; i++)
   {
-    gtk_container_foreach(GTK_CONTAINER(widget),
-                          (GtkCallback)get_advanced_settings,
-                          advanced_settings);
+    AdvancedDependent *dep = &g_array_index(dependents, AdvancedDependent, i);
+    guint j;
+
+    for (j = 0; j < settings->len; j++)
+    {
+      AdvancedSetting *setting = &g_array_index(settings, AdvancedSetting, j);
+
+      if (setting->widget == dep->widget && setting->changed)
+      {
+        ((void (*)(GtkWidget *, gpointer))dep->callback)(dep->widget,
+                                                         dep->user_data);
+        break;
+      }
+    }
   }
-  else if (!GTK_IS_LABEL(widget))
+
+  /* dependents may have written other settings, the snapshot wins */
+  if (dependents)
+    apply_advanced_settings(dependents, settings);
+}
+
+static void
+advanced_settings_free(GArray *settings)
+{
+  guint i;
+
+  for (i = 0; i < settings->len; i++)
   {
-    g_warning("%s: unhandled widget type %s (%s)", G_STRFUNC,
-              g_type_name(G_TYPE_FROM_INSTANCE(widget)), name);
+    AdvancedSetting *setting = &g_array_index(settings, AdvancedSetting, i);
+
+    if (setting->kind == ADVANCED_SETTING_STRING)
+      g_free(setting->value.s);
+
+    g_free(setting->field);
   }
+
+  g_array_free(settings, TRUE);
+}
+
+/* finds the settings widgets of @dialog and takes the initial snapshot */
+static GArray *
+advanced_settings_new(GtkWidget *dialog)
+{
+  GArray *settings = g_array_new(FALSE, FALSE, sizeof(AdvancedSetting));
+
+  find_advanced_settings(dialog, settings);
+  get_advanced_settings(settings);
+
+  return settings;
 }
 
 static void
 on_advanced_settings_response(GtkWidget *dialog, gint response,
                               RtcomDialogContext *context)
 {
-  GHashTable *advanced_settings =
-      g_object_get_data(G_OBJECT(context), "settings");
+  GArray *advanced_settings = g_object_get_data(G_OBJECT(context), "settings");
 
   if (response == GTK_RESPONSE_OK)
   {
@@ -97,7 +315,9 @@ on_advanced_settings_response(GtkWidget *dialog, gint response,
 
     if (rtcom_page_validate(RTCOM_PAGE(page), &error))
     {
-      get_advanced_settings(dialog, advanced_settings);
+      PLUGIN_TRACE_BEGIN("get_advanced_settings");
+      get_advanced_settings(advanced_settings);
+      PLUGIN_TRACE_END("get_advanced_settings");
       gtk_widget_hide(dialog);
     }
     else
@@ -114,7 +334,7 @@ on_advanced_settings_response(GtkWidget *dialog, gint response,
   }
   else
   {
-    g_hash_table_foreach(advanced_settings, set_widget_setting, dialog);
+    set_advanced_settings(dialog, advanced_settings);
     gtk_widget_hide(dialog);
   }
 }
@@ -0,0 +1,323 @@
+/*
+ * cm-cache.h
+ *
+ * Copyright (C) 2022 Ivaylo Dimitrov <ivo.g.dimitrov.75@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __CM_CACHE_H_INCLUDED__
+#define __CM_CACHE_H_INCLUDED__
+
+#include <errno.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#include <telepathy-glib/telepathy-glib.h>
+
+/*
+ * On-disk cache of the protocols each Telepathy connection manager
+ * implements, so plugins can register their services without waiting for
+ * every CM to answer over D-Bus. The cache is only trusted while the set of
+ * .manager files and their mtimes is the same as when it was written.
+ */
+
+#define CM_CACHE_GROUP_MANAGERS "managers"
+#define CM_CACHE_GROUP_PROTOCOLS "protocols"
+#define CM_CACHE_KEY_STAMP "stamp"
+
+static gchar *
+cm_cache_get_path(void)
+{
+  return g_build_filename(g_get_user_cache_dir(), PACKAGE, "cms.cache", NULL);
+}
+
+static void
+cm_cache_stamp_dir(const gchar *data_dir, GHashTable *managers)
+{
+  gchar *path = g_build_filename(data_dir, "telepathy", "managers", NULL);
+  GDir *dir = g_dir_open(path, 0, NULL);
+
+  if (dir)
+  {
+    const gchar *name;
+
+    while ((name = g_dir_read_name(dir)))
+    {
+      gchar *file;
+      GStatBuf st;
+
+      /* the first directory in XDG order wins, like in telepathy-glib */
+      if (!g_str_has_suffix(name, ".manager") ||
+          g_hash_table_contains(managers, name))
+      {
+        continue;
+      }
+
+      file = g_build_filename(path, name, NULL);
+
+      if (!g_stat(file, &st))
+      {
+        g_hash_table_insert(managers, g_strdup(name),
+                            g_strdup_printf("%s:%" G_GINT64_FORMAT, file,
+                                            (gint64)st.st_mtime));
+      }
+
+      g_free(file);
+    }
+
+    g_dir_close(dir);
+  }
+
+  g_free(path);
+}
+
+static gchar *
+cm_cache_get_stamp(void)
+{
+  GHashTable *managers = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               g_free, g_free);
+  const gchar *const *dirs = g_get_system_data_dirs();
+  GList *values;
+  GList *l;
+  GString *stamp = g_string_new(NULL);
+
+  cm_cache_stamp_dir(g_get_user_data_dir(), managers);
+
+  while (*dirs)
+    cm_cache_stamp_dir(*dirs++, managers);
+
+  values = g_list_sort(g_hash_table_get_values(managers),
+                       (GCompareFunc)strcmp);
+
+  for (l = values; l; l = l->next)
+  {
+    g_string_append(stamp, l->data);
+    g_string_append_c(stamp, ';');
+  }
+
+  g_list_free(values);
+  g_hash_table_destroy(managers);
+
+  return g_string_free(stamp, FALSE);
+}
+
+/*
+ * Returns TRUE if the cache is valid, in which case @cms is set to a
+ * NULL-terminated list of the CM names that implement @protocol (possibly
+ * empty). Free it with g_strfreev().
+ */
+static gboolean
+cm_cache_lookup(const gchar *protocol, gchar ***cms)
+{
+  GKeyFile *key_file = g_key_file_new();
+  gchar *path = cm_cache_get_path();
+  gboolean valid = FALSE;
+
+  *cms = NULL;
+
+  if (g_key_file_load_from_file(key_file, path, G_KEY_FILE_NONE, NULL))
+  {
+    gchar *cached_stamp = g_key_file_get_string(
+        key_file, CM_CACHE_GROUP_MANAGERS, CM_CACHE_KEY_STAMP, NULL);
+
+    if (cached_stamp)
+    {
+      gchar *stamp = cm_cache_get_stamp();
+
+      if (!strcmp(stamp, cached_stamp))
+      {
+        *cms = g_key_file_get_string_list(key_file, CM_CACHE_GROUP_PROTOCOLS,
+                                          protocol, NULL, NULL);
+
+        if (!*cms)
+          *cms = g_new0(gchar *, 1);
+
+        valid = TRUE;
+      }
+
+      g_free(stamp);
+      g_free(cached_stamp);
+    }
+  }
+
+  g_free(path);
+  g_key_file_free(key_file);
+
+  return valid;
+}
+
+static gint
+cm_cache_compare_names(gconstpointer a, gconstpointer b)
+{
+  return strcmp(*(const gchar * const *)a, *(const gchar * const *)b);
+}
+
+/* Writes the cache, unless what is on disk is the same already */
+static void
+cm_cache_update(GList *cms)
+{
+  GKeyFile *key_file = g_key_file_new();
+  GHashTable *protocols = g_hash_table_new_full(
+      g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_ptr_array_unref);
+  gchar *path = cm_cache_get_path();
+  gchar *dir = g_path_get_dirname(path);
+  gchar *stamp = cm_cache_get_stamp();
+  GError *error = NULL;
+  GList *keys;
+  gchar *data;
+  gchar *old_data = NULL;
+  gsize old_len;
+  gsize len;
+  GList *l;
+
+  g_key_file_set_string(key_file, CM_CACHE_GROUP_MANAGERS, CM_CACHE_KEY_STAMP,
+                        stamp);
+
+  for (l = cms; l; l = l->next)
+  {
+    gchar **names = tp_connection_manager_dup_protocol_names(l->data);
+    gchar **name;
+
+    for (name = names; name && *name; name++)
+    {
+      GPtrArray *arr = g_hash_table_lookup(protocols, *name);
+
+      if (!arr)
+      {
+        arr = g_ptr_array_new();
+        g_hash_table_insert(protocols, g_strdup(*name), arr);
+      }
+
+      g_ptr_array_add(arr,
+                      (gpointer)tp_connection_manager_get_name(l->data));
+    }
+
+    g_strfreev(names);
+  }
+
+  /* sorted, CMs answer in any order */
+  keys = g_list_sort(g_hash_table_get_keys(protocols), (GCompareFunc)strcmp);
+
+  for (l = keys; l; l = l->next)
+  {
+    GPtrArray *arr = g_hash_table_lookup(protocols, l->data);
+
+    g_ptr_array_sort(arr, cm_cache_compare_names);
+    g_key_file_set_string_list(key_file, CM_CACHE_GROUP_PROTOCOLS, l->data,
+                               (const gchar * const *)arr->pdata, arr->len);
+  }
+
+  g_list_free(keys);
+  data = g_key_file_to_data(key_file, &len, NULL);
+
+  /* most starts find the same CMs, spare the flash a write then */
+  if (!g_file_get_contents(path, &old_data, &old_len, NULL) ||
+      old_len != len || memcmp(old_data, data, len))
+  {
+    if (g_mkdir_with_parents(dir, 0700) ||
+        !g_file_set_contents(path, data, len, &error))
+    {
+      g_warning("%s: unable to write CM cache %s [%s]", G_STRFUNC, path,
+                error ? error->message : g_strerror(errno));
+      g_clear_error(&error);
+    }
+  }
+
+  g_free(old_data);
+  g_free(data);
+  g_free(stamp);
+  g_free(dir);
+  g_free(path);
+  g_hash_table_destroy(protocols);
+  g_key_file_free(key_file);
+}
+
+/*
+ * Helpers shared by the plugins that discover their services from
+ * connection managers. Services already added from the cache are not added
+ * again when the D-Bus walk revalidates it.
+ */
+static void
+cm_cache_add_service(RtcomAccountPlugin *plugin, const gchar *cm_name,
+                     const gchar *protocol)
+{
+  GHashTable *services = g_object_get_data(G_OBJECT(plugin), "cm-services");
+  gchar *service_id;
+
+  if (!services)
+  {
+    services = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    g_object_set_data_full(G_OBJECT(plugin), "cm-services", services,
+                           (GDestroyNotify)g_hash_table_destroy);
+  }
+
+  service_id = g_strconcat(cm_name, "/", protocol, NULL);
+
+  if (!g_hash_table_contains(services, service_id))
+  {
+    rtcom_account_plugin_add_service(plugin, service_id);
+    g_hash_table_add(services, service_id);
+  }
+  else
+    g_free(service_id);
+}
+
+static gboolean
+cm_cache_plugin_initialized_idle(gpointer user_data)
+{
+  rtcom_account_plugin_initialized(RTCOM_ACCOUNT_PLUGIN(user_data));
+
+  return FALSE;
+}
+
+/*
+ * Reported from an idle, as this may run from within instance init, before
+ * the loader has the plugin.
+ */
+static void
+cm_cache_plugin_initialized(RtcomAccountPlugin *plugin)
+{
+  if (!g_object_get_data(G_OBJECT(plugin), "cm-initialized"))
+  {
+    g_object_set_data(G_OBJECT(plugin), "cm-initialized",
+                      GINT_TO_POINTER(TRUE));
+    g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, cm_cache_plugin_initialized_idle,
+                    g_object_ref(plugin), g_object_unref);
+  }
+}
+
+/*
+ * Adds the services for @protocol from the cache and marks @plugin as
+ * initialized. Returns FALSE if there is no valid cache, in which case
+ * nothing is done.
+ */
+static gboolean
+cm_cache_add_services(RtcomAccountPlugin *plugin, const gchar *protocol)
+{
+  gchar **cms;
+  gchar **cm;
+
+  if (!cm_cache_lookup(protocol, &cms))
+    return FALSE;
+
+  for (cm = cms; *cm; cm++)
+    cm_cache_add_service(plugin, *cm, protocol);
+
+  g_strfreev(cms);
+  cm_cache_plugin_initialized(plugin);
+
+  return TRUE;
+}
+
+#endif /* __CM_CACHE_H_INCLUDED__ */
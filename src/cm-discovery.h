@@ -0,0 +1,324 @@
+/*
+ * cm-discovery.h
+ *
+ * Copyright (C) 2022 Ivaylo Dimitrov <ivo.g.dimitrov.75@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __CM_DISCOVERY_H_INCLUDED__
+#define __CM_DISCOVERY_H_INCLUDED__
+
+#include <telepathy-glib/telepathy-glib.h>
+
+#include "cm-cache.h"
+#include "plugin-trace.h"
+
+/*
+ * Connection manager discovery shared by all plugins in the process. Every
+ * plugin is a separate module, so the state hangs off the shared
+ * TpDBusDaemon instance: the first plugin to ask starts the enumeration,
+ * the others just register to be told about their protocol. Each CM is
+ * prepared on its own, so a slow or wedged one does not hold up the rest.
+ */
+
+#define CM_DISCOVERY_QUARK \
+  g_quark_from_static_string("rtcom-accounts-plugins-cm-discovery")
+
+/*
+ * How long to wait for a single CM before the plugins are initialized
+ * without it, in ms, overridable with RTCOM_ACCOUNTS_CM_TIMEOUT. Services of
+ * a late CM are still added when it eventually answers.
+ */
+#ifndef CM_DISCOVERY_TIMEOUT
+#define CM_DISCOVERY_TIMEOUT 3000
+#endif
+
+struct _CmDiscovery
+{
+  TpDBusDaemon *tp_dbus;
+  GHashTable *names;
+  GList *cms;
+  guint timeout;
+  /* bus name listings not yet returned */
+  guint pending_lists;
+  gboolean list_failed;
+  /* CMs still being prepared */
+  guint pending;
+  /* CMs neither prepared, failed nor timed out */
+  guint waiting;
+  GList *watchers;
+};
+
+typedef struct _CmDiscovery CmDiscovery;
+
+struct _CmDiscoveryWatcher
+{
+  RtcomAccountPlugin *plugin;
+  gchar *protocol;
+};
+
+typedef struct _CmDiscoveryWatcher CmDiscoveryWatcher;
+
+struct _CmDiscoveryManager
+{
+  CmDiscovery *discovery;
+  TpConnectionManager *cm;
+  guint timeout_id;
+};
+
+typedef struct _CmDiscoveryManager CmDiscoveryManager;
+
+static void
+cm_discovery_add_service(RtcomAccountPlugin *plugin, TpConnectionManager *cm,
+                         const gchar *protocol)
+{
+  if (tp_connection_manager_has_protocol(cm, protocol))
+  {
+    cm_cache_add_service(plugin, tp_connection_manager_get_name(cm),
+                         protocol);
+  }
+}
+
+static gboolean
+cm_discovery_is_initialized(CmDiscovery *discovery)
+{
+  return !discovery->pending_lists && !discovery->waiting;
+}
+
+static void
+cm_discovery_watcher_free(CmDiscoveryWatcher *watcher)
+{
+  g_object_unref(watcher->plugin);
+  g_free(watcher->protocol);
+  g_slice_free(CmDiscoveryWatcher, watcher);
+}
+
+static void
+cm_discovery_check(CmDiscovery *discovery)
+{
+  GList *l;
+
+  if (!cm_discovery_is_initialized(discovery))
+    return;
+
+  for (l = discovery->watchers; l; l = l->next)
+  {
+    CmDiscoveryWatcher *watcher = l->data;
+
+    cm_cache_plugin_initialized(watcher->plugin);
+  }
+
+  if (discovery->pending)
+    return;
+
+  if (!discovery->cms)
+    g_warning("No Telepathy connection managers found");
+
+  if (!discovery->list_failed)
+    cm_cache_update(discovery->cms);
+
+  PLUGIN_TRACE_ASYNC_END("cm_discovery", discovery);
+
+  g_list_free_full(discovery->watchers,
+                   (GDestroyNotify)cm_discovery_watcher_free);
+  discovery->watchers = NULL;
+}
+
+static gboolean
+cm_discovery_timeout_cb(gpointer user_data)
+{
+  CmDiscoveryManager *manager = user_data;
+
+  g_warning("Connection manager %s did not answer in %u ms, not waiting",
+            tp_connection_manager_get_name(manager->cm),
+            manager->discovery->timeout);
+
+  manager->timeout_id = 0;
+  manager->discovery->waiting--;
+  cm_discovery_check(manager->discovery);
+
+  return FALSE;
+}
+
+static void
+cm_discovery_cm_ready_cb(GObject *object, GAsyncResult *res,
+                         gpointer user_data)
+{
+  CmDiscoveryManager *manager = user_data;
+  CmDiscovery *discovery = manager->discovery;
+  GError *error = NULL;
+
+  PLUGIN_TRACE_ASYNC_END("cm_prepare", manager->cm);
+  PLUGIN_TRACE_BEGIN("cm_discovery_cm_ready_cb");
+
+  if (manager->timeout_id)
+  {
+    g_source_remove(manager->timeout_id);
+    discovery->waiting--;
+  }
+
+  if (tp_proxy_prepare_finish(object, res, &error))
+  {
+    GList *l;
+
+    discovery->cms = g_list_append(discovery->cms, manager->cm);
+
+    for (l = discovery->watchers; l; l = l->next)
+    {
+      CmDiscoveryWatcher *watcher = l->data;
+
+      cm_discovery_add_service(watcher->plugin, manager->cm,
+                               watcher->protocol);
+    }
+  }
+  else
+  {
+    g_warning("Error preparing connection manager %s: %s",
+              tp_connection_manager_get_name(manager->cm), error->message);
+    g_error_free(error);
+    g_object_unref(manager->cm);
+  }
+
+  discovery->pending--;
+  g_slice_free(CmDiscoveryManager, manager);
+  cm_discovery_check(discovery);
+  PLUGIN_TRACE_END("cm_discovery_cm_ready_cb");
+}
+
+static void
+cm_discovery_names_cb(TpDBusDaemon *tp_dbus, const gchar * const *names,
+                      const GError *error, gpointer user_data,
+                      GObject *weak_object)
+{
+  CmDiscovery *discovery = user_data;
+
+  discovery->pending_lists--;
+
+  if (error)
+  {
+    g_warning("Error getting list of CMs: %s", error->message);
+    discovery->list_failed = TRUE;
+  }
+
+  for (; names && *names; names++)
+  {
+    const gchar *cm_name;
+    CmDiscoveryManager *manager;
+    TpConnectionManager *cm;
+    GError *err = NULL;
+
+    if (!g_str_has_prefix(*names, TP_CM_BUS_NAME_BASE))
+      continue;
+
+    cm_name = *names + strlen(TP_CM_BUS_NAME_BASE);
+
+    if (g_hash_table_contains(discovery->names, cm_name))
+      continue;
+
+    g_hash_table_add(discovery->names, g_strdup(cm_name));
+    cm = tp_connection_manager_new(tp_dbus, cm_name, NULL, &err);
+
+    if (!cm)
+    {
+      g_warning("%s: tp_connection_manager_new(%s) failed [%s]",
+                __FUNCTION__, cm_name, err->message);
+      g_error_free(err);
+      continue;
+    }
+
+    manager = g_slice_new(CmDiscoveryManager);
+    manager->discovery = discovery;
+    manager->cm = cm;
+    manager->timeout_id = g_timeout_add(discovery->timeout,
+                                        cm_discovery_timeout_cb, manager);
+    discovery->pending++;
+    discovery->waiting++;
+    PLUGIN_TRACE_ASYNC_BEGIN("cm_prepare", cm);
+    tp_proxy_prepare_async(cm, NULL, cm_discovery_cm_ready_cb, manager);
+  }
+
+  cm_discovery_check(discovery);
+}
+
+/*
+ * Registers the "<cm>/@protocol" services of @plugin, from the cache if it
+ * is still valid, and then from the single per-process enumeration of the
+ * connection managers as each of them answers. @plugin is initialized once
+ * every CM either answered or timed out.
+ */
+static void
+cm_discovery_watch(RtcomAccountPlugin *plugin, const gchar *protocol)
+{
+  GError *error = NULL;
+  TpDBusDaemon *tp_dbus;
+  CmDiscovery *discovery;
+  GList *l;
+
+  cm_cache_add_services(plugin, protocol);
+
+  tp_dbus = tp_dbus_daemon_dup(&error);
+
+  if (!tp_dbus)
+  {
+    g_warning("%s: tp_dbus_daemon_dup() failed [%s]", __FUNCTION__,
+              error->message);
+    g_error_free(error);
+    return;
+  }
+
+  discovery = g_object_get_qdata(G_OBJECT(tp_dbus), CM_DISCOVERY_QUARK);
+
+  if (!discovery)
+  {
+    const gchar *timeout = g_getenv("RTCOM_ACCOUNTS_CM_TIMEOUT");
+
+    /* lives as long as the process, like the daemon proxy holding it */
+    discovery = g_slice_new0(CmDiscovery);
+    discovery->tp_dbus = tp_dbus;
+    discovery->names = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                             g_free, NULL);
+    discovery->timeout = CM_DISCOVERY_TIMEOUT;
+
+    if (timeout && *timeout)
+      discovery->timeout = strtoul(timeout, NULL, 10);
+
+    discovery->pending_lists = 2;
+    g_object_set_qdata(G_OBJECT(tp_dbus), CM_DISCOVERY_QUARK, discovery);
+    PLUGIN_TRACE_ASYNC_BEGIN("cm_discovery", discovery);
+    tp_dbus_daemon_list_activatable_names(tp_dbus, -1, cm_discovery_names_cb,
+                                          discovery, NULL, NULL);
+    tp_dbus_daemon_list_names(tp_dbus, -1, cm_discovery_names_cb,
+                              discovery, NULL, NULL);
+  }
+  else
+    g_object_unref(tp_dbus);
+
+  for (l = discovery->cms; l; l = l->next)
+    cm_discovery_add_service(plugin, l->data, protocol);
+
+  if (cm_discovery_is_initialized(discovery))
+    cm_cache_plugin_initialized(plugin);
+
+  if (discovery->pending_lists || discovery->pending)
+  {
+    CmDiscoveryWatcher *watcher = g_slice_new(CmDiscoveryWatcher);
+
+    watcher->plugin = g_object_ref(plugin);
+    watcher->protocol = g_strdup(protocol);
+    discovery->watchers = g_list_append(discovery->watchers, watcher);
+  }
+}
+
+#endif /* __CM_DISCOVERY_H_INCLUDED__ */
@@ -1,2 +1,3 @@
 #!/bin/sh
-cc -I. -DG_LOG_DOMAIN="\"rtcom-accounts-ui\"" -DGETTEXT_PACKAGE="\"osso-applet-accounts\"" -DPLUGIN_XML_DIR="\"`pkg-config --variable=profiles_dir libmcclient`\"" `pkg-config --cflags --libs rtcom-accounts-widgets libglade-2.0 telepathy-glib` -W -Wall -O2 -shared -Wl,-soname=libgtalk-plugin.so.0 gtalk-plugin.c -o libgtalk-plugin.so.0.0.0
+glib-compile-resources --target=gtalk-resources.c --sourcedir=../data --generate-source --c-name plugin --internal ../data/gtalk-plugin.gresource.xml
+cc -I. -DG_LOG_DOMAIN="\"rtcom-accounts-ui\"" -DGETTEXT_PACKAGE="\"osso-applet-accounts\"" `pkg-config --cflags --libs rtcom-accounts-widgets libglade-2.0 telepathy-glib gio-2.0` -W -Wall -O2 -shared -Wl,-soname=libgtalk-plugin.so.0 gtalk-plugin.c gtalk-resources.c -o libgtalk-plugin.so.0.0.0
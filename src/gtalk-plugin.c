@@ -12,6 +12,8 @@
 #include <librtcom-accounts-widgets/rtcom-param-int.h>
 
 #include "advanced-page.h"
+#include "plugin-trace.h"
+#include "plugin-ui.h"
 
 #define GTALK_FORGOT_PASSWORD_URI \
   "https://www.google.com/accounts/ForgotPasswd?service=mail&fpOnly=1"
@@ -40,6 +42,7 @@ gtalk_plugin_init(GtalkPlugin *self)
 {
   RtcomAccountService *service;
 
+  PLUGIN_TRACE_BEGIN("gtalk_plugin_init");
   RTCOM_ACCOUNT_PLUGIN(self)->name = "google-talk";
   RTCOM_ACCOUNT_PLUGIN(self)->username_prefill = "@gmail.com";
   RTCOM_ACCOUNT_PLUGIN(self)->capabilities = RTCOM_PLUGIN_CAPABILITY_ALL;
@@ -51,6 +54,7 @@ gtalk_plugin_init(GtalkPlugin *self)
                NULL);
 
   glade_init();
+  PLUGIN_TRACE_END("gtalk_plugin_init");
 }
 
 static void
@@ -103,19 +107,21 @@ create_advanced_settings_page(RtcomDialogContext *context)
     const gchar *profile_name;
     GtkWidget *start_page;
     GtkWidget *autostun_button;
-    GHashTable *hash;
+    GArray *settings;
     gchar title[200];
     const gchar *text;
     const gchar *msg;
-    GladeXML *xml = glade_xml_new(PLUGIN_XML_DIR "/gtalk-advanced.glade",
-                                  NULL, GETTEXT_PACKAGE);
+    GladeXML *xml;
 
+    PLUGIN_TRACE_BEGIN("gtalk:create_advanced_settings_page");
+    xml = plugin_ui_new("gtalk-advanced.glade", NULL);
     rtcom_dialog_context_take_obj(context, G_OBJECT(xml));
     dialog = glade_xml_get_widget(xml, "advanced");
 
     if (!dialog)
     {
       g_warning("Unable to load Advanced settings dialog");
+      PLUGIN_TRACE_END("gtalk:create_advanced_settings_page");
       return dialog;
     }
 
@@ -150,6 +156,9 @@ create_advanced_settings_page(RtcomDialogContext *context)
     glade_xml_signal_connect(xml, "on_autostun_toggled",
                              G_CALLBACK(gtalk_plugin_on_autostun_toggled_cb));
     autostun_button = glade_xml_get_widget(xml, "autostun-Button-finger");
+    advanced_settings_add_dependent(
+          dialog, autostun_button,
+          G_CALLBACK(gtalk_plugin_on_autostun_toggled_cb), NULL);
 
     text = gtk_entry_get_text(
           GTK_ENTRY(glade_xml_get_widget(xml, "stun-server")));
@@ -161,17 +170,18 @@ create_advanced_settings_page(RtcomDialogContext *context)
     }
 
     gtalk_plugin_on_autostun_toggled_cb(autostun_button);
-    hash = g_hash_table_new((GHashFunc)g_direct_hash,
-                            (GEqualFunc)g_direct_equal);
-    get_advanced_settings(dialog, hash);
-    g_object_set_data_full(G_OBJECT(context), "settings", hash,
-                           (GDestroyNotify)g_hash_table_destroy);
+    PLUGIN_TRACE_BEGIN("gtalk:get_advanced_settings");
+    settings = advanced_settings_new(dialog);
+    PLUGIN_TRACE_END("gtalk:get_advanced_settings");
+    g_object_set_data_full(G_OBJECT(context), "settings", settings,
+                           (GDestroyNotify)advanced_settings_free);
+
+    g_signal_connect(dialog, "response",
+                     G_CALLBACK(on_advanced_settings_response), context);
+    g_signal_connect(dialog, "delete-event", G_CALLBACK(gtk_true), NULL);
+    PLUGIN_TRACE_END("gtalk:create_advanced_settings_page");
   }
 
-  g_signal_connect(dialog, "response",
-                   G_CALLBACK(on_advanced_settings_response), context);
-  g_signal_connect(dialog, "delete-event", G_CALLBACK(gtk_true), NULL);
-
   return dialog;
 }
 
@@ -224,9 +234,15 @@ gtalk_plugin_context_init(RtcomAccountPlugin *plugin,
 
   static const gchar *invalid_chars_re = "[:'\"<>&;#\\s]";
 
+  PLUGIN_TRACE_BEGIN("gtalk_plugin_context_init");
   editing = account_edit_context_get_editing(ACCOUNT_EDIT_CONTEXT(context));
   account = account_edit_context_get_account(ACCOUNT_EDIT_CONTEXT(context));
-  create_advanced_settings_page(context);
+
+  /* new accounts store the defaults Advanced shows, even if never opened */
+  if (editing)
+    plugin_ui_preload("gtalk-advanced.glade");
+  else
+    create_advanced_settings_page(context);
 
   if (editing)
   {
@@ -271,6 +287,7 @@ gtalk_plugin_context_init(RtcomAccountPlugin *plugin,
   }
 
   rtcom_dialog_context_set_start_page(context, page);
+  PLUGIN_TRACE_END("gtalk_plugin_context_init");
 }
 
 static void
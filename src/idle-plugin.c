@@ -29,6 +29,9 @@
 #include <librtcom-accounts-widgets/rtcom-login.h>
 #include <librtcom-accounts-widgets/rtcom-param-string.h>
 
+#include "plugin-trace.h"
+#include "plugin-ui.h"
+
 typedef struct _IdlePluginClass IdlePluginClass;
 typedef struct _IdlePlugin IdlePlugin;
 
@@ -49,6 +52,7 @@ idle_plugin_init(IdlePlugin *self)
 {
   RtcomAccountService *service;
 
+  PLUGIN_TRACE_BEGIN("idle_plugin_init");
   RTCOM_ACCOUNT_PLUGIN(self)->name = "idle";
   RTCOM_ACCOUNT_PLUGIN(self)->capabilities =
       RTCOM_PLUGIN_CAPABILITY_ALLOW_MULTIPLE |
@@ -61,6 +65,7 @@ idle_plugin_init(IdlePlugin *self)
                NULL);
 
   glade_init();
+  PLUGIN_TRACE_END("idle_plugin_init");
 }
 
 static void
@@ -107,15 +112,17 @@ create_advanced_settings_page(RtcomDialogContext *context)
     GtkWidget *start_page;
     gchar title[200];
     const gchar *msg;
-    GladeXML *xml = glade_xml_new(PLUGIN_XML_DIR "/idle-advanced.glade",
-                                  NULL, GETTEXT_PACKAGE);
+    GladeXML *xml;
 
+    PLUGIN_TRACE_BEGIN("idle:create_advanced_settings_page");
+    xml = plugin_ui_new("idle-advanced.glade", NULL);
     rtcom_dialog_context_take_obj(context, G_OBJECT(xml));
     dialog = glade_xml_get_widget(xml, "advanced");
 
     if (!dialog)
     {
       g_warning("Unable to load Advanced settings dialog");
+      PLUGIN_TRACE_END("idle:create_advanced_settings_page");
       return dialog;
     }
 
@@ -146,11 +153,12 @@ create_advanced_settings_page(RtcomDialogContext *context)
     g_object_ref(dialog);
     g_object_set_data_full(
           G_OBJECT(context), "page_advanced", dialog, g_object_unref);
-  }
 
-  g_signal_connect(dialog, "response",
-                   G_CALLBACK(on_advanced_settings_response), context);
-  g_signal_connect(dialog, "delete-event", G_CALLBACK(gtk_true), NULL);
+    g_signal_connect(dialog, "response",
+                     G_CALLBACK(on_advanced_settings_response), context);
+    g_signal_connect(dialog, "delete-event", G_CALLBACK(gtk_true), NULL);
+    PLUGIN_TRACE_END("idle:create_advanced_settings_page");
+  }
 
   return dialog;
 }
@@ -174,9 +182,14 @@ idle_plugin_context_init(RtcomAccountPlugin *plugin,
   GtkWidget *page;
   static const gchar *invalid_chars_re = "[:'\"<>&;#\\s]";
 
+  PLUGIN_TRACE_BEGIN("idle_plugin_context_init");
   editing = account_edit_context_get_editing(ACCOUNT_EDIT_CONTEXT(context));
   account = account_edit_context_get_account(ACCOUNT_EDIT_CONTEXT(context));
-  create_advanced_settings_page(context);
+
+  if (editing)
+    plugin_ui_preload("idle-advanced.glade");
+  else
+    create_advanced_settings_page(context);
 
   if (editing)
   {
@@ -250,6 +263,7 @@ idle_plugin_context_init(RtcomAccountPlugin *plugin,
   }
 
   rtcom_dialog_context_set_start_page(context, page);
+  PLUGIN_TRACE_END("idle_plugin_context_init");
 }
 
 static void
@@ -18,6 +18,7 @@
  */
 #include "config.h"
 
+#include <errno.h>
 #include <glade/glade.h>
 #include <glib/gi18n-lib.h>
 #include <hildon/hildon.h>
@@ -31,6 +32,10 @@
 #include <telepathy-glib/telepathy-glib.h>
 
 #include "advanced-page.h"
+#include "cm-discovery.h"
+#include "plugin-trace.h"
+#include "plugin-ui.h"
+#include "protocol-params.h"
 
 #define JABBER_TYPE_PLUGIN (jabber_plugin_get_type())
 #define JABBER_PLUGIN(obj) \
@@ -49,78 +54,47 @@ struct _JabberPluginClass
   RtcomAccountPluginClass parent_class;
 };
 
-struct _JabberPluginPrivate
-{
-  GtkWidget *registering_dialog;
-};
-
-typedef struct _JabberPluginPrivate JabberPluginPrivate;
-
-ACCOUNT_DEFINE_PLUGIN_WITH_PRIVATE(
-  JabberPlugin,
-  jabber_plugin,
-  RTCOM_TYPE_ACCOUNT_PLUGIN
-);
+/*
+ * How long to wait for an in-band registration to finish, in ms,
+ * overridable with RTCOM_ACCOUNTS_REGISTER_TIMEOUT.
+ */
+#ifndef JABBER_REGISTER_TIMEOUT
+#define JABBER_REGISTER_TIMEOUT 60000
+#endif
 
-static void
-cms_ready_cb(GObject *object, GAsyncResult *res, gpointer user_data)
+/*
+ * A registration in progress, owned by its dialog context as "registration".
+ * It is dropped on completion, timeout, the user closing the progress dialog
+ * or the context going away. That only detaches the UI: the connection
+ * callback holds a reference to @cancellable only and ignores a cancelled
+ * result, but the connection asked to register keeps going, and may still
+ * create the account on the server.
+ */
+struct _JabberRegistration
 {
-  RtcomAccountPlugin *plugin = user_data;
-  GError *error = NULL;
-  GList *cms = tp_list_connection_managers_finish(res, &error);
-  GList *l;
-
-  if (error != NULL)
-  {
-    g_warning("Error getting list of CMs: %s", error->message);
-    g_error_free(error);
-  }
-  else if (!cms)
-    g_warning("No Telepathy connection managers found");
-
-  for (l = cms; l; l = l->next)
-  {
-    if (tp_connection_manager_has_protocol(l->data, "jabber"))
-    {
-      gchar *service_id = g_strconcat(tp_connection_manager_get_name(l->data),
-                                      "/jabber", NULL);
-
-      rtcom_account_plugin_add_service(plugin, service_id);
-      g_free(service_id);
-    }
-  }
-
-  rtcom_account_plugin_initialized(plugin);
+  GCancellable *cancellable;
+  GtkWidget *dialog;
+  GtkWidget *progress;
+  guint timeout;
+  guint timeout_id;
+};
 
-  g_list_free(cms);
+typedef struct _JabberRegistration JabberRegistration;
 
-  g_object_unref(plugin);
-}
+ACCOUNT_DEFINE_PLUGIN(JabberPlugin, jabber_plugin, RTCOM_TYPE_ACCOUNT_PLUGIN);
 
 static void
 jabber_plugin_init(JabberPlugin *plugin)
 {
-  GError *error = NULL;
-  TpDBusDaemon *tp_dbus = tp_dbus_daemon_dup(&error);
-
-  if (tp_dbus)
-  {
-    tp_list_connection_managers_async(tp_dbus, cms_ready_cb,
-                                      g_object_ref(plugin));
-  }
-  else
-  {
-    g_warning("%s: tp_dbus_daemon_dup() failed [%s]", __FUNCTION__,
-              error->message);
-    g_error_free(error);
-  }
-
+  PLUGIN_TRACE_BEGIN("jabber_plugin_init");
   RTCOM_ACCOUNT_PLUGIN(plugin)->name = "jabber";
   RTCOM_ACCOUNT_PLUGIN(plugin)->username_prefill = NULL;
   RTCOM_ACCOUNT_PLUGIN(plugin)->capabilities =
     RTCOM_PLUGIN_CAPABILITY_ALL & ~RTCOM_PLUGIN_CAPABILITY_FORGOT_PWD;
 
+  cm_discovery_watch(RTCOM_ACCOUNT_PLUGIN(plugin), "jabber");
   glade_init();
+  PLUGIN_TRACE_END("jabber_plugin_init");
 }
 
 static void
@@ -196,8 +170,7 @@ create_advanced_settings_page(RtcomDialogContext *context)
 
   if (!dialog)
   {
-    GladeXML *xml = glade_xml_new(
-        PLUGIN_XML_DIR "/jabber-advanced.glade", NULL, GETTEXT_PACKAGE);
+    GladeXML *xml;
     AccountItem *account;
     GtkWidget *require_encryption_button;
     GtkWidget *force_old_ssl_button;
@@ -206,14 +179,17 @@ create_advanced_settings_page(RtcomDialogContext *context)
     AccountService *service;
     gchar *title;
     const gchar *fmt;
-    GHashTable *settings;
+    GArray *settings;
 
+    PLUGIN_TRACE_BEGIN("jabber:create_advanced_settings_page");
+    xml = plugin_ui_new("jabber-advanced.glade", NULL);
     rtcom_dialog_context_take_obj(context, G_OBJECT(xml));
     dialog = glade_xml_get_widget(xml, "advanced");
 
     if (!dialog)
     {
       g_warning("Unable to load Advanced settings dialog");
+      PLUGIN_TRACE_END("jabber:create_advanced_settings_page");
       return dialog;
     }
 
@@ -229,12 +205,18 @@ create_advanced_settings_page(RtcomDialogContext *context)
         xml, "require-encryption-Button-finger");
     glade_xml_signal_connect(xml, "on_require_encryption_toggled",
                              G_CALLBACK(on_require_encryption_toggled_cb));
+    advanced_settings_add_dependent(
+      dialog, require_encryption_button,
+      G_CALLBACK(on_require_encryption_toggled_cb), NULL);
     on_require_encryption_toggled_cb(require_encryption_button);
 
     force_old_ssl_button = glade_xml_get_widget(
         xml, "force-old-ssl-Button-finger");
     glade_xml_signal_connect(xml, "on_force_old_ssl_toggled",
                              G_CALLBACK(on_force_old_ssl_toggled_cb));
+    advanced_settings_add_dependent(
+      dialog, force_old_ssl_button,
+      G_CALLBACK(on_force_old_ssl_toggled_cb), NULL);
     on_force_old_ssl_toggled_cb(force_old_ssl_button);
 
     ignore_ssl_errors_button = glade_xml_get_widget(
@@ -255,16 +237,18 @@ create_advanced_settings_page(RtcomDialogContext *context)
                                  get_parent_window(context));
     gtk_window_set_destroy_with_parent(GTK_WINDOW(dialog), TRUE);
 
-    settings = g_hash_table_new(g_direct_hash, g_direct_equal);
-    get_advanced_settings(dialog, settings);
+    PLUGIN_TRACE_BEGIN("jabber:get_advanced_settings");
+    settings = advanced_settings_new(dialog);
+    PLUGIN_TRACE_END("jabber:get_advanced_settings");
     g_object_set_data_full(G_OBJECT(context), "settings", settings,
-                           (GDestroyNotify)g_hash_table_destroy);
-  }
+                           (GDestroyNotify)advanced_settings_free);
 
-  g_signal_connect(dialog, "response",
-                   G_CALLBACK(on_advanced_settings_response), context);
-  g_signal_connect(dialog, "delete-event",
-                   G_CALLBACK(gtk_true), NULL);
+    g_signal_connect(dialog, "response",
+                     G_CALLBACK(on_advanced_settings_response), context);
+    g_signal_connect(dialog, "delete-event",
+                     G_CALLBACK(gtk_true), NULL);
+    PLUGIN_TRACE_END("jabber:create_advanced_settings_page");
+  }
 
   return dialog;
 }
@@ -278,59 +262,115 @@ jabber_plugin_on_advanced_cb(RtcomDialogContext *context)
 }
 
 static void
-param_copy(gpointer key, gpointer value, GHashTable *register_settings)
+param_copy(AdvancedSetting *setting, GHashTable *register_settings)
 {
-  if (RTCOM_IS_PARAM_STRING(key) && value && *(gchar *)value)
-  {
-    GValue *v = tp_g_value_slice_new(G_TYPE_STRING);
+  GValue *v;
 
-    g_value_set_static_string(v, value);
-    g_hash_table_insert(register_settings,
-                        (gchar *)rtcom_param_string_get_field(key), v);
-  }
-  else if (RTCOM_IS_PARAM_BOOL(key))
+  switch (setting->kind)
   {
-    GValue *v = tp_g_value_slice_new(G_TYPE_BOOLEAN);
+    case ADVANCED_SETTING_STRING:
+    {
+      if (!setting->value.s || !*setting->value.s)
+        return;
 
-    g_value_set_boolean(v, GPOINTER_TO_INT(value));
-    g_hash_table_insert(register_settings,
-                        (gchar *)rtcom_param_bool_get_field(key), v);
+      v = tp_g_value_slice_new(G_TYPE_STRING);
+      g_value_set_static_string(v, setting->value.s);
+      break;
+    }
+    case ADVANCED_SETTING_BOOL:
+    {
+      v = tp_g_value_slice_new(G_TYPE_BOOLEAN);
+      g_value_set_boolean(v, setting->value.b);
+      break;
+    }
+    case ADVANCED_SETTING_INT:
+    {
+      v = tp_g_value_slice_new(G_TYPE_UINT);
+      g_value_set_uint(v, setting->value.i);
+      break;
+    }
+    default:
+      return;
   }
-  else if (RTCOM_IS_PARAM_INT(key))
-  {
-    GValue *v = tp_g_value_slice_new(G_TYPE_UINT);
 
-    g_value_set_uint(v, GPOINTER_TO_UINT(value));
-    g_hash_table_insert(register_settings,
-                        (gchar *)rtcom_param_int_get_field(key), v);
-  }
+  g_hash_table_insert(register_settings, setting->field, v);
+}
+
+static void
+jabber_registration_free(JabberRegistration *registration)
+{
+  PLUGIN_TRACE_ASYNC_END("jabber:register", registration->cancellable);
+  g_cancellable_cancel(registration->cancellable);
+  g_object_unref(registration->cancellable);
+
+  if (registration->timeout_id)
+    g_source_remove(registration->timeout_id);
+
+  gtk_widget_destroy(registration->progress);
+  g_slice_free(JabberRegistration, registration);
+}
+
+static void
+jabber_registration_cancel(RtcomDialogContext *context)
+{
+  g_object_set_data(G_OBJECT(context), "registration", NULL);
+}
+
+static gboolean
+jabber_registration_timeout_cb(gpointer user_data)
+{
+  RtcomDialogContext *context = user_data;
+  JabberRegistration *registration =
+    g_object_get_data(G_OBJECT(context), "registration");
+
+  g_warning("Registration did not finish in %u ms, cancelled",
+            registration->timeout);
+  registration->timeout_id = 0;
+  /* the system's own, localized, "Connection timed out" */
+  hildon_banner_show_information(registration->dialog, NULL,
+                                 g_strerror(ETIMEDOUT));
+  jabber_registration_cancel(context);
+
+  return FALSE;
+}
+
+static void
+on_registering_response_cb(GtkWidget *progress, gint response,
+                           RtcomDialogContext *context)
+{
+  jabber_registration_cancel(context);
 }
 
 static void
 service_connection_cb(GObject *requester, TpConnection *connection,
                       GError *error, gpointer user_data)
 {
-  AccountPlugin *plugin;
-  JabberPluginPrivate *priv;
-
-  plugin = account_edit_context_get_plugin(ACCOUNT_EDIT_CONTEXT(requester));
-  priv = jabber_plugin_get_instance_private(JABBER_PLUGIN(plugin));
+  GCancellable *cancellable = user_data;
 
-  if (priv->registering_dialog)
+  /* the registration, and maybe the whole context, is gone */
+  if (!g_cancellable_is_cancelled(cancellable))
   {
-    gtk_widget_destroy(priv->registering_dialog);
-    priv->registering_dialog = NULL;
-  }
+    RtcomDialogContext *context = RTCOM_DIALOG_CONTEXT(requester);
+    JabberRegistration *registration =
+      g_object_get_data(G_OBJECT(context), "registration");
 
-  if (error)
-    hildon_banner_show_information(user_data, NULL, error->message);
-  else
-  {
-    GtkWindow *dialog = get_parent_window(RTCOM_DIALOG_CONTEXT(requester));
+    if (error)
+    {
+      hildon_banner_show_information(registration->dialog, NULL,
+                                     error->message);
+      jabber_registration_cancel(context);
+    }
+    else
+    {
+      GtkWindow *dialog = get_parent_window(context);
 
-    rtcom_dialog_context_set_start_page(RTCOM_DIALOG_CONTEXT(requester), NULL);
-    gtk_dialog_response(GTK_DIALOG(dialog), 1);
+      jabber_registration_cancel(context);
+      rtcom_dialog_context_set_start_page(context, NULL);
+      gtk_dialog_response(GTK_DIALOG(dialog), 1);
+    }
   }
+
+  g_object_unref(cancellable);
 }
 
 static void
@@ -342,21 +382,21 @@ on_register_response_cb(GtkWidget *dialog, gint response,
   const gchar *username;
   const gchar *password;
   const gchar *password2;
-  GHashTable *settings;
+  GArray *settings;
   GValue *v;
   AccountItem *account;
   AccountService *service;
-  AccountPlugin *plugin;
-  JabberPluginPrivate *priv;
+  JabberRegistration *registration;
   const gchar *fmt;
+  const gchar *timeout;
   gchar *registering_msg;
-  GtkWidget *registering_dialog;
   GHashTable *register_settings;
   GError *error = NULL;
 
   if (response != GTK_RESPONSE_OK)
   {
-    gtk_widget_destroy(dialog);
+    jabber_registration_cancel(context);
+    gtk_widget_hide(dialog);
     return;
   }
 
@@ -392,33 +432,36 @@ on_register_response_cb(GtkWidget *dialog, gint response,
   service = account_item_get_service(account);
   register_settings = g_hash_table_new_full(
       g_str_hash, g_str_equal, NULL, (GDestroyNotify)tp_g_value_slice_free);
+  create_advanced_settings_page(context);
   settings = g_object_get_data(G_OBJECT(context), "settings");
 
   if (settings)
   {
-    GHashTableIter iter;
-    gpointer key, value;
-    g_hash_table_iter_init (&iter, settings);
+    TpProtocol *protocol =
+      rtcom_account_service_get_protocol(RTCOM_ACCOUNT_SERVICE(service));
+    guint i;
 
-    while (g_hash_table_iter_next (&iter, &key, &value))
+    PLUGIN_TRACE_BEGIN("jabber:param_copy");
+
+    for (i = 0; i < settings->len; i++)
     {
-      gchar *field;
+      AdvancedSetting *setting = &g_array_index(settings, AdvancedSetting, i);
 
-      g_object_get(key, "field", &field, NULL);
+      if (!setting->field)
+        continue;
 
-      if (rtcom_account_service_get_param_type(RTCOM_ACCOUNT_SERVICE(service),
-                                               field) != G_TYPE_INVALID)
+      if (protocol && protocol_params_lookup(protocol, setting->field))
       {
-        param_copy(key, value, register_settings);
+        param_copy(setting, register_settings);
       }
       else
       {
-        g_warning("Parameter %s is not supported by service %s", field,
-                  service->name);
+        g_warning("Parameter %s is not supported by service %s",
+                  setting->field, service->name);
       }
-
-      g_free(field);
     }
+
+    PLUGIN_TRACE_END("jabber:param_copy");
   }
 
   v = tp_g_value_slice_new(G_TYPE_BOOLEAN);
@@ -433,38 +476,54 @@ on_register_response_cb(GtkWidget *dialog, gint response,
   g_value_set_static_string(v, password);
   g_hash_table_insert(register_settings, "password", v);
 
-  plugin = account_edit_context_get_plugin(&context->parent_instance);
-  rtcom_account_service_connect(RTCOM_ACCOUNT_SERVICE(service),
-                                register_settings, G_OBJECT(context), TRUE,
-                                service_connection_cb, dialog);
-  g_hash_table_unref(register_settings);
+  registration = g_slice_new(JabberRegistration);
+  registration->cancellable = g_cancellable_new();
+  registration->dialog = dialog;
+  registration->timeout = JABBER_REGISTER_TIMEOUT;
+  timeout = g_getenv("RTCOM_ACCOUNTS_REGISTER_TIMEOUT");
 
-  priv = jabber_plugin_get_instance_private(JABBER_PLUGIN(plugin));
+  if (timeout && *timeout)
+    registration->timeout = strtoul(timeout, NULL, 10);
 
   fmt = _("accounts_ti_registering");
   registering_msg = g_strdup_printf(fmt, username);
-  registering_dialog = gtk_dialog_new();
-  gtk_window_set_title(GTK_WINDOW(registering_dialog), registering_msg);
-  gtk_dialog_set_has_separator(GTK_DIALOG(registering_dialog), FALSE);
+  registration->progress = gtk_dialog_new();
+  gtk_window_set_title(GTK_WINDOW(registration->progress), registering_msg);
+  gtk_dialog_set_has_separator(GTK_DIALOG(registration->progress), FALSE);
   g_free(registering_msg);
-  hildon_gtk_window_set_progress_indicator(GTK_WINDOW(registering_dialog), 1);
+  hildon_gtk_window_set_progress_indicator(
+    GTK_WINDOW(registration->progress), 1);
 
   if (account->service_icon)
   {
-    gtk_box_pack_start(GTK_BOX(GTK_DIALOG(registering_dialog)->vbox),
+    gtk_box_pack_start(GTK_BOX(GTK_DIALOG(registration->progress)->vbox),
                        gtk_image_new_from_pixbuf(account->service_icon),
                        FALSE, FALSE, 16);
   }
 
-  if (dialog)
-  {
-    gtk_window_set_transient_for((GtkWindow *)registering_dialog,
-                                 (GtkWindow *)dialog);
-    gtk_window_set_modal((GtkWindow *)registering_dialog, 0);
-  }
+  gtk_window_set_transient_for(GTK_WINDOW(registration->progress),
+                               GTK_WINDOW(dialog));
+  gtk_window_set_modal(GTK_WINDOW(registration->progress), FALSE);
+
+  /* closing the progress dialog is how the user cancels */
+  g_signal_connect(registration->progress, "response",
+                   G_CALLBACK(on_registering_response_cb), context);
+
+  /* replaces, and so cancels, any registration still running */
+  g_object_set_data_full(G_OBJECT(context), "registration", registration,
+                         (GDestroyNotify)jabber_registration_free);
+  registration->timeout_id = g_timeout_add(registration->timeout,
+                                           jabber_registration_timeout_cb,
+                                           context);
+
+  gtk_widget_show_all(registration->progress);
 
-  priv->registering_dialog = registering_dialog;
-  gtk_widget_show_all(registering_dialog);
+  PLUGIN_TRACE_ASYNC_BEGIN("jabber:register", registration->cancellable);
+  rtcom_account_service_connect(RTCOM_ACCOUNT_SERVICE(service),
+                                register_settings, G_OBJECT(context), TRUE,
+                                service_connection_cb,
+                                g_object_ref(registration->cancellable));
+  g_hash_table_unref(register_settings);
 
   return;
 
@@ -477,24 +536,31 @@ err:
   }
 }
 
-static void
-jabber_plugin_on_register_cb(RtcomDialogContext *context)
+static GtkWidget *
+create_register_dialog(RtcomDialogContext *context)
 {
   GtkWidget *dialog;
 
-  GladeXML *xml = glade_xml_new(
-      PLUGIN_XML_DIR "/jabber-new-account.glade", NULL, GETTEXT_PACKAGE);
+  dialog = g_object_get_data(G_OBJECT(context), "page_register");
 
-  rtcom_dialog_context_take_obj(context, G_OBJECT(xml));
-  dialog = glade_xml_get_widget(xml, "register");
-
-  if (dialog)
+  if (!dialog)
   {
-    GtkWidget *advanced_button =
-      glade_xml_get_widget(xml, "advanced-button-Button-finger");
+    GladeXML *xml = plugin_ui_new("jabber-new-account.glade", NULL);
+    GtkWidget *advanced_button;
     AccountItem *account;
     GtkWidget *page;
 
+    rtcom_dialog_context_take_obj(context, G_OBJECT(xml));
+    dialog = glade_xml_get_widget(xml, "register");
+
+    if (!dialog)
+    {
+      g_warning("Unable to load Register dialog");
+      return dialog;
+    }
+
+    advanced_button =
+      glade_xml_get_widget(xml, "advanced-button-Button-finger");
     g_signal_connect_swapped(advanced_button, "clicked",
                              G_CALLBACK(jabber_plugin_on_advanced_cb), context);
     gtk_dialog_add_buttons(GTK_DIALOG(dialog), _("accounts_bd_register"),
@@ -505,12 +571,27 @@ jabber_plugin_on_register_cb(RtcomDialogContext *context)
     gtk_window_set_title(GTK_WINDOW(dialog),
                          _("accounts_ti_new_jabber_account"));
     gtk_window_set_transient_for(GTK_WINDOW(dialog), get_parent_window(context));
+    gtk_window_set_destroy_with_parent(GTK_WINDOW(dialog), TRUE);
+
+    /* hidden on close and shown again on the next Register click */
+    g_object_ref(dialog);
+    g_object_set_data_full(G_OBJECT(context), "page_register", dialog,
+                           g_object_unref);
     g_signal_connect(dialog, "response",
                      G_CALLBACK(on_register_response_cb), context);
-    gtk_widget_show_all(dialog);
+    g_signal_connect(dialog, "delete-event", G_CALLBACK(gtk_true), NULL);
   }
-  else
-    g_warning("Unable to load Register dialog");
+
+  return dialog;
+}
+
+static void
+jabber_plugin_on_register_cb(RtcomDialogContext *context)
+{
+  GtkWidget *dialog = create_register_dialog(context);
+
+  if (dialog)
+    gtk_widget_show_all(dialog);
 }
 
 static void
@@ -521,9 +602,17 @@ jabber_plugin_context_init(RtcomAccountPlugin *plugin,
   gboolean editing;
   AccountItem *account;
 
+  PLUGIN_TRACE_BEGIN("jabber_plugin_context_init");
   editing = account_edit_context_get_editing(ACCOUNT_EDIT_CONTEXT(context));
   account = account_edit_context_get_account(ACCOUNT_EDIT_CONTEXT(context));
-  create_advanced_settings_page(context);
+
+  if (editing)
+    plugin_ui_preload("jabber-advanced.glade");
+  else
+  {
+    plugin_ui_preload("jabber-new-account.glade");
+    create_advanced_settings_page(context);
+  }
 
   if (editing)
   {
@@ -561,6 +650,7 @@ jabber_plugin_context_init(RtcomAccountPlugin *plugin,
   }
 
   rtcom_dialog_context_set_start_page(context, page);
+  PLUGIN_TRACE_END("jabber_plugin_context_init");
 }
 
 static void
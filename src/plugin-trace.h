@@ -0,0 +1,249 @@
+/*
+ * plugin-trace.h
+ *
+ * Copyright (C) 2022 Ivaylo Dimitrov <ivo.g.dimitrov.75@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __PLUGIN_TRACE_H_INCLUDED__
+#define __PLUGIN_TRACE_H_INCLUDED__
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+/*
+ * Timing probes, written in Chrome trace event format (JSON array) to the
+ * file named by RTCOM_ACCOUNTS_TRACE, to be loaded in chrome://tracing or
+ * Perfetto. Every plugin module appends to the same file, one event per
+ * write(), and the closing ']' is left out, which both viewers accept.
+ *
+ * With RTCOM_ACCOUNTS_TRACE_HEAP set as well, every span also records the
+ * malloc heap in use when it ends and how much it grew while it ran, shown
+ * as "heap" and "heap_delta" in the slice arguments. When the module goes
+ * away, the calls and summed deltas of each span name are printed to stderr.
+ *
+ * The heap is the process-wide malloc heap, so a delta also counts whatever
+ * other threads, GTK and GLib allocated or freed while the span was open.
+ * The UI parse workers are traced as "plugin_ui_parse" spans on their own
+ * threads, to tell their share apart. Objects are not counted.
+ */
+
+static gint plugin_trace_fd = -2;
+static gboolean plugin_trace_heap = FALSE;
+
+struct _PluginTraceHeapTotal
+{
+  guint calls;
+  gint64 delta;
+};
+
+typedef struct _PluginTraceHeapTotal PluginTraceHeapTotal;
+
+/* span name -> PluginTraceHeapTotal, spans end on more than one thread */
+static GHashTable *plugin_trace_heap_totals = NULL;
+static GMutex plugin_trace_heap_lock;
+
+/* heap sizes at the open spans of the calling thread */
+static GPrivate plugin_trace_heap_stack =
+  G_PRIVATE_INIT((GDestroyNotify)g_array_unref);
+
+static gint64
+plugin_trace_heap_size(void)
+{
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 33)
+  struct mallinfo2 mi = mallinfo2();
+
+  return (gint64)mi.uordblks + (gint64)mi.hblkhd;
+#else
+  struct mallinfo mi = mallinfo();
+
+  return (gint64)(guint)mi.uordblks + (gint64)(guint)mi.hblkhd;
+#endif
+#else
+  return -1;
+#endif
+}
+
+static gboolean
+plugin_trace_enabled(void)
+{
+  if (plugin_trace_fd == -2)
+  {
+    const gchar *path = g_getenv("RTCOM_ACCOUNTS_TRACE");
+
+    plugin_trace_fd = -1;
+
+    if (path && *path)
+    {
+      plugin_trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+
+      if (plugin_trace_fd >= 0)
+      {
+        struct stat st;
+
+        if (!fstat(plugin_trace_fd, &st) && !st.st_size &&
+            write(plugin_trace_fd, "[\n", 2) != 2)
+        {
+          close(plugin_trace_fd);
+          plugin_trace_fd = -1;
+        }
+      }
+
+      if (plugin_trace_fd < 0)
+        g_warning("Unable to open trace file %s", path);
+      else if (g_getenv("RTCOM_ACCOUNTS_TRACE_HEAP"))
+        plugin_trace_heap = TRUE;
+    }
+  }
+
+  return plugin_trace_fd >= 0;
+}
+
+static void
+plugin_trace_heap_add(const gchar *name, gint64 delta)
+{
+  PluginTraceHeapTotal *total;
+
+  g_mutex_lock(&plugin_trace_heap_lock);
+
+  if (!plugin_trace_heap_totals)
+  {
+    /* span names are literals of this module, which outlive the table */
+    plugin_trace_heap_totals = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                     NULL, g_free);
+  }
+
+  total = g_hash_table_lookup(plugin_trace_heap_totals, name);
+
+  if (!total)
+  {
+    total = g_new0(PluginTraceHeapTotal, 1);
+    g_hash_table_insert(plugin_trace_heap_totals, (gpointer)name, total);
+  }
+
+  total->calls++;
+  total->delta += delta;
+  g_mutex_unlock(&plugin_trace_heap_lock);
+}
+
+/* runs at exit, or when the plugin module is unloaded before that */
+__attribute__((destructor)) static void
+plugin_trace_heap_report(void)
+{
+  GList *names;
+  GList *l;
+
+  if (!plugin_trace_heap_totals)
+    return;
+
+  names = g_list_sort(g_hash_table_get_keys(plugin_trace_heap_totals),
+                      (GCompareFunc)strcmp);
+  g_printerr("%s: heap growth per span, summed over calls\n", G_LOG_DOMAIN);
+
+  for (l = names; l; l = l->next)
+  {
+    PluginTraceHeapTotal *total =
+      g_hash_table_lookup(plugin_trace_heap_totals, l->data);
+
+    g_printerr("  %-40s %6u calls %12" G_GINT64_FORMAT " bytes\n",
+               (const gchar *)l->data, total->calls, total->delta);
+  }
+
+  g_list_free(names);
+  g_hash_table_destroy(plugin_trace_heap_totals);
+  plugin_trace_heap_totals = NULL;
+}
+
+static void
+plugin_trace_event(const gchar *name, gchar phase, gconstpointer id)
+{
+  gchar buf[256];
+  gchar args[80] = "";
+  gint len;
+
+  if (!plugin_trace_enabled())
+    return;
+
+  if (plugin_trace_heap && (phase == 'B' || phase == 'E'))
+  {
+    GArray *stack = g_private_get(&plugin_trace_heap_stack);
+    gint64 heap = plugin_trace_heap_size();
+
+    if (!stack)
+    {
+      stack = g_array_new(FALSE, FALSE, sizeof(gint64));
+      g_private_set(&plugin_trace_heap_stack, stack);
+    }
+
+    if (phase == 'B')
+      g_array_append_val(stack, heap);
+    else if (stack->len)
+    {
+      guint top = stack->len - 1;
+      gint64 start = g_array_index(stack, gint64, top);
+
+      g_array_set_size(stack, top);
+      plugin_trace_heap_add(name, heap - start);
+      g_snprintf(args, sizeof(args),
+                 ",\"args\":{\"heap\":%" G_GINT64_FORMAT
+                 ",\"heap_delta\":%" G_GINT64_FORMAT "}",
+                 heap, heap - start);
+    }
+  }
+
+  if (id)
+  {
+    len = g_snprintf(buf, sizeof(buf),
+                     "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\","
+                     "\"ts\":%" G_GINT64_FORMAT ",\"pid\":%d,\"tid\":%ld,"
+                     "\"id\":\"%p\"},\n",
+                     name, G_LOG_DOMAIN, phase, g_get_monotonic_time(),
+                     getpid(), (long)syscall(SYS_gettid), id);
+  }
+  else
+  {
+    len = g_snprintf(buf, sizeof(buf),
+                     "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\","
+                     "\"ts\":%" G_GINT64_FORMAT ",\"pid\":%d,\"tid\":%ld%s},\n",
+                     name, G_LOG_DOMAIN, phase, g_get_monotonic_time(),
+                     getpid(), (long)syscall(SYS_gettid), args);
+  }
+
+  if (len >= (gint)sizeof(buf))
+    return;
+
+  if (write(plugin_trace_fd, buf, len) != len)
+    g_warning("%s: short write to trace file", G_STRFUNC);
+}
+
+/* a span that begins and ends in the same function on the same thread */
+#define PLUGIN_TRACE_BEGIN(name) plugin_trace_event((name), 'B', NULL)
+#define PLUGIN_TRACE_END(name) plugin_trace_event((name), 'E', NULL)
+
+/* a span that ends in a callback, matched by @id */
+#define PLUGIN_TRACE_ASYNC_BEGIN(name, id) plugin_trace_event((name), 'b', (id))
+#define PLUGIN_TRACE_ASYNC_END(name, id) plugin_trace_event((name), 'e', (id))
+
+#endif /* __PLUGIN_TRACE_H_INCLUDED__ */
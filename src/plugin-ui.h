@@ -0,0 +1,235 @@
+/*
+ * plugin-ui.h
+ *
+ * Copyright (C) 2022 Ivaylo Dimitrov <ivo.g.dimitrov.75@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __PLUGIN_UI_H_INCLUDED__
+#define __PLUGIN_UI_H_INCLUDED__
+
+#include <gio/gio.h>
+#include <glade/glade.h>
+#include <glade/glade-build.h>
+#include <glade/glade-parser.h>
+#include <libxml/parser.h>
+
+#include "plugin-trace.h"
+
+/*
+ * Each plugin has its own .glade files compiled in as a GResource (see
+ * data/<plugin>-plugin.gresource.xml), so building a dialog does not touch
+ * the filesystem.
+ *
+ * Each UI is parsed only once per process, optionally in a worker thread.
+ * The resulting GladeInterface is kept as a template and every GladeXML is
+ * built from it on the main thread. Unlike glade_xml_new(), the GladeXML
+ * objects do not own a copy of the parse tree, they only map widget names
+ * and signals.
+ */
+
+#define PLUGIN_UI_RESOURCE_PATH "/org/maemo/rtcom-accounts-plugins/"
+
+struct _PluginUiTemplate
+{
+  GladeInterface *iface;
+  gboolean loaded;
+  gboolean required;
+};
+
+typedef struct _PluginUiTemplate PluginUiTemplate;
+
+/* templates can be filled from a worker thread, see plugin_ui_preload() */
+static GMutex plugin_ui_lock;
+static GCond plugin_ui_cond;
+static GHashTable *plugin_ui_templates = NULL;
+
+/* only touches plain data, so it is safe to call from any thread */
+static GladeInterface *
+plugin_ui_parse(const gchar *name)
+{
+  gchar *path = g_strconcat(PLUGIN_UI_RESOURCE_PATH, name, NULL);
+  GladeInterface *iface = NULL;
+  GError *error = NULL;
+  GBytes *data;
+
+  data = g_resources_lookup_data(path, G_RESOURCE_LOOKUP_FLAGS_NONE, &error);
+
+  if (data)
+  {
+    gsize size;
+    const gchar *buffer = g_bytes_get_data(data, &size);
+
+    iface = glade_parser_parse_buffer(buffer, size, GETTEXT_PACKAGE);
+    g_bytes_unref(data);
+
+    if (!iface)
+      g_warning("%s: unable to parse UI %s", G_STRFUNC, path);
+  }
+  else
+  {
+    g_warning("%s: unable to find UI %s [%s]", G_STRFUNC, path,
+              error->message);
+    g_error_free(error);
+  }
+
+  g_free(path);
+
+  return iface;
+}
+
+/* must be called with plugin_ui_lock held */
+static PluginUiTemplate *
+plugin_ui_lookup_template(const gchar *name, gboolean *created)
+{
+  PluginUiTemplate *tmpl;
+
+  if (!plugin_ui_templates)
+    plugin_ui_templates = g_hash_table_new(g_str_hash, g_str_equal);
+
+  tmpl = g_hash_table_lookup(plugin_ui_templates, name);
+  *created = !tmpl;
+
+  if (!tmpl)
+  {
+    tmpl = g_slice_new0(PluginUiTemplate);
+    g_hash_table_insert(plugin_ui_templates, g_strdup(name), tmpl);
+  }
+
+  return tmpl;
+}
+
+static void
+plugin_ui_set_template(PluginUiTemplate *tmpl, GladeInterface *iface)
+{
+  g_mutex_lock(&plugin_ui_lock);
+  tmpl->iface = iface;
+  tmpl->loaded = TRUE;
+  g_cond_broadcast(&plugin_ui_cond);
+  g_mutex_unlock(&plugin_ui_lock);
+}
+
+static void
+plugin_ui_parse_thread(GTask *task, gpointer source_object,
+                       gpointer task_data, GCancellable *cancellable)
+{
+  const gchar *name = task_data;
+  PluginUiTemplate *tmpl;
+  gboolean created;
+
+  g_mutex_lock(&plugin_ui_lock);
+  tmpl = plugin_ui_lookup_template(name, &created);
+  g_mutex_unlock(&plugin_ui_lock);
+
+  PLUGIN_TRACE_BEGIN("plugin_ui_parse");
+  plugin_ui_set_template(tmpl, plugin_ui_parse(name));
+  PLUGIN_TRACE_END("plugin_ui_parse");
+  g_task_return_boolean(task, TRUE);
+}
+
+/*
+ * Starts parsing UI @name in a worker thread, so the parse is done by the
+ * time the dialog is needed. Only the widgets are built on the main thread.
+ */
+static void
+plugin_ui_preload(const gchar *name)
+{
+  gboolean created;
+  GTask *task;
+
+  g_mutex_lock(&plugin_ui_lock);
+  plugin_ui_lookup_template(name, &created);
+  g_mutex_unlock(&plugin_ui_lock);
+
+  if (!created)
+    return;
+
+  /* older libxml2 does not set itself up thread-safely on first use */
+  xmlInitParser();
+
+  task = g_task_new(NULL, NULL, NULL, NULL);
+  g_task_set_task_data(task, g_strdup(name), g_free);
+  g_task_run_in_thread(task, plugin_ui_parse_thread);
+  g_object_unref(task);
+}
+
+static GladeInterface *
+plugin_ui_get_template(const gchar *name)
+{
+  PluginUiTemplate *tmpl;
+  gboolean created;
+
+  g_mutex_lock(&plugin_ui_lock);
+  tmpl = plugin_ui_lookup_template(name, &created);
+
+  /* not preloaded, parse here */
+  if (created)
+  {
+    g_mutex_unlock(&plugin_ui_lock);
+    plugin_ui_set_template(tmpl, plugin_ui_parse(name));
+    g_mutex_lock(&plugin_ui_lock);
+  }
+
+  while (!tmpl->loaded)
+    g_cond_wait(&plugin_ui_cond, &plugin_ui_lock);
+
+  g_mutex_unlock(&plugin_ui_lock);
+
+  /* loading libglade modules registers types, keep it on the main thread */
+  if (tmpl->iface && !tmpl->required)
+  {
+    guint i;
+
+    for (i = 0; i < tmpl->iface->n_requires; i++)
+      glade_require(tmpl->iface->requires[i]);
+
+    tmpl->required = TRUE;
+  }
+
+  return tmpl->iface;
+}
+
+static GladeXML *
+plugin_ui_new(const gchar *name, const gchar *root)
+{
+  GladeInterface *iface = plugin_ui_get_template(name);
+  GladeXML *xml;
+
+  if (!iface)
+    return NULL;
+
+  xml = g_object_new(GLADE_TYPE_XML, NULL);
+
+  if (root)
+  {
+    GladeWidgetInfo *info = g_hash_table_lookup(iface->names, root);
+
+    if (info)
+      glade_xml_build_widget(xml, info);
+    else
+      g_warning("%s: no widget %s in UI %s", G_STRFUNC, root, name);
+  }
+  else
+  {
+    guint i;
+
+    for (i = 0; i < iface->n_toplevels; i++)
+      glade_xml_build_widget(xml, iface->toplevels[i]);
+  }
+
+  return xml;
+}
+
+#endif /* __PLUGIN_UI_H_INCLUDED__ */
@@ -0,0 +1,135 @@
+/*
+ * protocol-params.h
+ *
+ * Copyright (C) 2022 Ivaylo Dimitrov <ivo.g.dimitrov.75@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __PROTOCOL_PARAMS_H_INCLUDED__
+#define __PROTOCOL_PARAMS_H_INCLUDED__
+
+#include <telepathy-glib/telepathy-glib.h>
+
+/*
+ * Parameter signatures and string defaults of a protocol, collected once and
+ * kept on the TpProtocol itself, so every plugin and dialog using the same
+ * CM shares them and they go away together with the CM proxy.
+ */
+
+#define PROTOCOL_PARAMS_QUARK \
+  g_quark_from_static_string("rtcom-accounts-plugins-protocol-params")
+
+struct _ProtocolParam
+{
+  gchar *signature;
+  gchar *default_value;
+};
+
+typedef struct _ProtocolParam ProtocolParam;
+
+static void
+protocol_param_free(ProtocolParam *param)
+{
+  g_free(param->signature);
+  g_free(param->default_value);
+  g_slice_free(ProtocolParam, param);
+}
+
+static GHashTable *
+protocol_params_get(TpProtocol *protocol)
+{
+  GHashTable *params = g_object_get_qdata(G_OBJECT(protocol),
+                                          PROTOCOL_PARAMS_QUARK);
+
+  if (!params)
+  {
+    GList *all = tp_protocol_dup_params(protocol);
+    GList *l;
+
+    params = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                   (GDestroyNotify)protocol_param_free);
+
+    for (l = all; l; l = l->next)
+    {
+      ProtocolParam *param = g_slice_new0(ProtocolParam);
+      GValue v = G_VALUE_INIT;
+
+      param->signature =
+        g_strdup(tp_connection_manager_param_get_dbus_signature(l->data));
+
+      if (tp_connection_manager_param_get_default(l->data, &v))
+      {
+        if (G_VALUE_HOLDS_STRING(&v))
+          param->default_value = g_value_dup_string(&v);
+
+        g_value_unset(&v);
+      }
+
+      g_hash_table_insert(
+        params, g_strdup(tp_connection_manager_param_get_name(l->data)),
+        param);
+    }
+
+    g_list_free_full(all, (GDestroyNotify)tp_connection_manager_param_free);
+    g_object_set_qdata_full(G_OBJECT(protocol), PROTOCOL_PARAMS_QUARK, params,
+                            (GDestroyNotify)g_hash_table_destroy);
+  }
+
+  return params;
+}
+
+/* Returns NULL if @protocol has no parameter @name */
+static const ProtocolParam *
+protocol_params_lookup(TpProtocol *protocol, const gchar *name)
+{
+  return g_hash_table_lookup(protocol_params_get(protocol), name);
+}
+
+#define PROTOCOL_AUDIO_CALL_QUARK \
+  g_quark_from_static_string("rtcom-accounts-plugins-protocol-audio-call")
+
+/*
+ * Whether @protocol can do audio calls with any kind of handle. Computed once
+ * and kept on the protocol like the parameters above, but only once the
+ * capabilities are known. Only the SIP plugin asks.
+ */
+G_GNUC_UNUSED static gboolean
+protocol_supports_audio_call(TpProtocol *protocol)
+{
+  gpointer cached = g_object_get_qdata(G_OBJECT(protocol),
+                                       PROTOCOL_AUDIO_CALL_QUARK);
+
+  if (!cached)
+  {
+    TpCapabilities *caps = tp_protocol_get_capabilities(protocol);
+    gboolean supported;
+
+    if (!caps)
+      return FALSE;
+
+    supported =
+      tp_capabilities_supports_audio_call(caps, TP_HANDLE_TYPE_CONTACT) ||
+      tp_capabilities_supports_audio_call(caps, TP_HANDLE_TYPE_NONE) ||
+      tp_capabilities_supports_audio_call(caps, TP_HANDLE_TYPE_ROOM);
+
+    /* stored off by one, so that "not supported" is not NULL */
+    cached = GINT_TO_POINTER(supported + 1);
+    g_object_set_qdata(G_OBJECT(protocol), PROTOCOL_AUDIO_CALL_QUARK, cached);
+  }
+
+  return GPOINTER_TO_INT(cached) - 1;
+}
+
+#endif /* __PROTOCOL_PARAMS_H_INCLUDED__ */
@@ -30,6 +30,10 @@
 #include <librtcom-accounts-widgets/rtcom-param-int.h>
 
 #include "advanced-page.h"
+#include "cm-discovery.h"
+#include "plugin-trace.h"
+#include "plugin-ui.h"
+#include "protocol-params.h"
 
 #define INVALID_CHARS_RE "[:'\"<>&;#\\s]"
 #define BUTTON(id) id "-Button-finger"
@@ -49,7 +53,8 @@ struct _SipPluginClass
 
 struct _SipPluginPrivate
 {
-  GList *accounts;
+  /* AccountItem -> sip_account, for dialog contexts still alive */
+  GHashTable *accounts;
 };
 
 typedef struct _SipPluginPrivate SipPluginPrivate;
@@ -65,6 +70,7 @@ struct _sip_account
 {
   AccountItem *item;
   RtcomDialogContext *context;
+  SipPluginPrivate *priv;
 };
 
 typedef struct _sip_account sip_account;
@@ -106,125 +112,110 @@ static const item_description keepalive_interval_items[] =
 };
 
 static void
-cms_ready_cb(GObject *object, GAsyncResult *res, gpointer user_data)
+sip_plugin_init(SipPlugin *plugin)
 {
-  RtcomAccountPlugin *plugin = user_data;
-  GError *error = NULL;
-  GList *cms = tp_list_connection_managers_finish(res, &error);
-  GList *l;
+  PLUGIN_TRACE_BEGIN("sip_plugin_init");
+  RTCOM_ACCOUNT_PLUGIN(plugin)->name = "sip";
+  RTCOM_ACCOUNT_PLUGIN(plugin)->capabilities =
+    RTCOM_PLUGIN_CAPABILITY_ADVANCED |
+    RTCOM_PLUGIN_CAPABILITY_ALLOW_MULTIPLE |
+    RTCOM_PLUGIN_CAPABILITY_PASSWORD;
 
-  if (error != NULL)
-  {
-    g_warning("Error getting list of CMs: %s", error->message);
-    g_error_free(error);
-  }
-  else if (!cms)
-    g_warning("No Telepathy connection managers found");
+  cm_discovery_watch(RTCOM_ACCOUNT_PLUGIN(plugin), "sip");
+  glade_init();
+  PLUGIN_TRACE_END("sip_plugin_init");
+}
 
-  for (l = cms; l; l = l->next)
+static gint
+get_button_value(GtkWidget *button)
+{
+  if (HILDON_IS_PICKER_BUTTON(button))
   {
-    if (tp_connection_manager_has_protocol(l->data, "sip"))
-    {
-      gchar *id;
+    gint idx = hildon_picker_button_get_active(HILDON_PICKER_BUTTON(button));
 
-      id = g_strconcat(tp_connection_manager_get_name(l->data), "/sip", NULL);
-      rtcom_account_plugin_add_service(plugin, id);
-      g_free(id);
-    }
+    return idx < 0 ? 0 : idx;
   }
 
-  rtcom_account_plugin_initialized(plugin);
-
-  g_list_free(cms);
-
-  g_object_unref(plugin);
+  return hildon_check_button_get_active(HILDON_CHECK_BUTTON(button));
 }
 
+/* remembers what is stored for @button, to skip writing it unchanged */
 static void
-sip_plugin_init(SipPlugin *plugin)
+set_button_baseline(GtkWidget *button)
 {
-  GError *error = NULL;
-  TpDBusDaemon *tp_dbus = tp_dbus_daemon_dup(&error);
+  g_object_set_data(G_OBJECT(button), "baseline",
+                    GINT_TO_POINTER(get_button_value(button)));
+}
 
-  if (tp_dbus)
-  {
-    tp_list_connection_managers_async(tp_dbus, cms_ready_cb,
-                                      g_object_ref(plugin));
-  }
-  else
-  {
-    g_warning("%s: tp_dbus_daemon_dup() failed [%s]", __FUNCTION__,
-              error->message);
-    g_error_free(error);
-  }
+static gboolean
+get_button_changed(RtcomAccountItem *item, GtkWidget *button, gint *value)
+{
+  *value = get_button_value(button);
 
-  RTCOM_ACCOUNT_PLUGIN(plugin)->name = "sip";
-  RTCOM_ACCOUNT_PLUGIN(plugin)->capabilities =
-    RTCOM_PLUGIN_CAPABILITY_ADVANCED |
-    RTCOM_PLUGIN_CAPABILITY_ALLOW_MULTIPLE |
-    RTCOM_PLUGIN_CAPABILITY_PASSWORD;
+  /* nothing is stored for a new account yet */
+  if (!item->account)
+    return TRUE;
 
-  glade_init();
+  return GPOINTER_TO_INT(g_object_get_data(G_OBJECT(button), "baseline")) !=
+         *value;
 }
 
+/*
+ * The store calls below only queue the values on @item, which sends all of
+ * them to the account manager in a single asynchronous update once every
+ * "store-settings" handler returned.
+ */
 static gboolean
 on_store_settings(RtcomAccountItem *item, GError **error, sip_account *sa)
 {
   RtcomDialogContext *context = sa->context;
   GtkWidget *button;
+  gint idx;
 
   g_return_val_if_fail(RTCOM_IS_DIALOG_CONTEXT(context), TRUE);
 
+  /* new accounts always have it, editing without opening it changes nothing */
+  if (!g_object_get_data(G_OBJECT(context), "page_advanced"))
+    return TRUE;
+
+  PLUGIN_TRACE_BEGIN("sip:on_store_settings");
   button = g_object_get_data(G_OBJECT(context), BUTTON("cellular-call"));
 
-  if (button)
+  if (button && get_button_changed(item, button, &idx))
   {
     GList *l = NULL;
 
-    if (hildon_check_button_get_active(HILDON_CHECK_BUTTON(button)))
+    if (idx)
       l = g_list_append(NULL, "tel");
 
     rtcom_account_item_store_secondary_vcard_fields(item, l);
     g_list_free(l);
+    set_button_baseline(button);
   }
 
   button = g_object_get_data(G_OBJECT(context), BUTTON("transport"));
 
-  if (button)
+  if (button && get_button_changed(item, button, &idx))
   {
-    gint idx = hildon_picker_button_get_active(HILDON_PICKER_BUTTON(button));
-
-    if (idx < 0)
-      idx = 0;
-
     rtcom_account_item_store_param_string(item, "transport",
                                           transport_items[idx].value);
+    set_button_baseline(button);
   }
 
   button = g_object_get_data(G_OBJECT(context), BUTTON("keepalive-mechanism"));
 
-  if (button)
+  if (button && get_button_changed(item, button, &idx))
   {
-    gint idx = hildon_picker_button_get_active(HILDON_PICKER_BUTTON(button));
-
-    if (idx < 0)
-      idx = 0;
-
     rtcom_account_item_store_param_string(item, "keepalive-mechanism",
                                           keepalive_mechanizm_items[idx].value);
+    set_button_baseline(button);
   }
 
   button = g_object_get_data(G_OBJECT(context), BUTTON("keepalive-interval"));
 
-  if (button)
+  if (button && get_button_changed(item, button, &idx))
   {
-    gint idx = hildon_picker_button_get_active(HILDON_PICKER_BUTTON(button));
-    const char *interval;
-
-    if (idx < 0)
-      idx = 0;
-
-    interval = keepalive_interval_items[idx].value;
+    const char *interval = keepalive_interval_items[idx].value;
 
     if (interval)
     {
@@ -233,24 +224,41 @@ on_store_settings(RtcomAccountItem *item, GError **error, sip_account *sa)
     }
     else
       rtcom_account_item_unset_param(item, "keepalive-interval");
+
+    set_button_baseline(button);
   }
 
+  PLUGIN_TRACE_END("sip:on_store_settings");
+
   return TRUE;
 }
 
+static void
+sip_account_context_destroyed(gpointer data, GObject *where_the_object_was)
+{
+  sip_account *sa = data;
+
+  sa->context = NULL;
+  g_hash_table_remove(sa->priv->accounts, sa->item);
+}
+
 static void
 sip_account_destroy(gpointer data)
 {
   sip_account *sa = data;
 
+  g_signal_handlers_disconnect_matched(
+    sa->item,
+    G_SIGNAL_MATCH_DATA | G_SIGNAL_MATCH_FUNC,
+    0, 0, NULL, on_store_settings, sa);
+
   if (sa->context)
   {
-    g_signal_handlers_disconnect_matched(
-      sa->item,
-      G_SIGNAL_MATCH_DATA | G_SIGNAL_MATCH_FUNC,
-      0, 0, NULL, on_store_settings, sa);
+    g_object_weak_unref(G_OBJECT(sa->context), sip_account_context_destroyed,
+                        sa);
   }
 
+  g_object_unref(sa->item);
   g_slice_free(sip_account, sa);
 }
 
@@ -259,7 +267,8 @@ sip_plugin_finalize(GObject *object)
 {
   SipPluginPrivate *priv = PRIVATE(object);
 
-  g_list_free_full(priv->accounts, sip_account_destroy);
+  if (priv->accounts)
+    g_hash_table_destroy(priv->accounts);
 
   G_OBJECT_CLASS(sip_plugin_parent_class)->finalize(object);
 }
@@ -272,20 +281,10 @@ account_get_default_setting(RtcomAccountItem *item, const gchar *setting)
 
   if (protocol)
   {
-    const TpConnectionManagerParam *param;
-
-    param = tp_protocol_get_param(protocol, setting);
+    const ProtocolParam *param = protocol_params_lookup(protocol, setting);
 
     if (param)
-    {
-      GValue v = G_VALUE_INIT;
-
-      if (tp_connection_manager_param_get_default(param, &v) &&
-          G_VALUE_HOLDS_STRING(&v))
-      {
-        rv = g_value_dup_string(&v);
-      }
-    }
+      rv = g_strdup(param->default_value);
 
     g_object_unref(protocol);
   }
@@ -472,8 +471,7 @@ create_advanced_settings_page(RtcomDialogContext *context)
 
   if (!dialog)
   {
-    GladeXML *xml = glade_xml_new(
-        PLUGIN_XML_DIR "/sip-advanced.glade", NULL, GETTEXT_PACKAGE);
+    GladeXML *xml;
     gboolean cellular_active = TRUE;
     gchar title[200];
     GtkWidget *page;
@@ -482,17 +480,20 @@ create_advanced_settings_page(RtcomDialogContext *context)
     TpProtocol *protocol;
     GtkWidget *selector;
     GtkWidget *button;
-    GHashTable *settings;
+    GArray *settings;
     RtcomAccountItem *item;
     const gchar *msgid;
     int i;
 
+    PLUGIN_TRACE_BEGIN("sip:create_advanced_settings_page");
+    xml = plugin_ui_new("sip-advanced.glade", NULL);
     rtcom_dialog_context_take_obj(context, G_OBJECT(xml));
     dialog = glade_xml_get_widget(xml, "advanced");
 
     if (!dialog)
     {
       g_warning("Unable to load Advanced settings dialog");
+      PLUGIN_TRACE_END("sip:create_advanced_settings_page");
       return dialog;
     }
 
@@ -540,14 +541,8 @@ create_advanced_settings_page(RtcomDialogContext *context)
 
     if (protocol)
     {
-      TpCapabilities *caps = tp_protocol_get_capabilities(protocol);
-
-      if (tp_capabilities_supports_audio_call(caps, TP_HANDLE_TYPE_CONTACT) ||
-          tp_capabilities_supports_audio_call(caps, TP_HANDLE_TYPE_NONE) ||
-          tp_capabilities_supports_audio_call(caps, TP_HANDLE_TYPE_ROOM))
-      {
+      if (protocol_supports_audio_call(protocol))
         gtk_widget_show(button);
-      }
       else
         gtk_widget_hide(button);
     }
@@ -587,6 +582,7 @@ create_advanced_settings_page(RtcomDialogContext *context)
 
     hildon_check_button_set_active(HILDON_CHECK_BUTTON(button),
                                    cellular_active);
+    set_button_baseline(button);
 
     /* transport */
     selector = hildon_touch_selector_new_text();
@@ -604,6 +600,7 @@ create_advanced_settings_page(RtcomDialogContext *context)
                      G_CALLBACK(transport_value_changed_cb), NULL);
     transport_value_changed_cb(button, NULL);
     g_object_set_data(G_OBJECT(context), BUTTON("transport"), button);
+    set_button_baseline(button);
 
     /* keepalive-mechanism */
     selector = hildon_touch_selector_new_text();
@@ -621,6 +618,7 @@ create_advanced_settings_page(RtcomDialogContext *context)
                              G_N_ELEMENTS(keepalive_mechanizm_items), item,
                              "keepalive-mechanism");
     g_object_set_data(G_OBJECT(context), BUTTON("keepalive-mechanism"), button);
+    set_button_baseline(button);
 
     /* keepalive-interval */
     selector = hildon_touch_selector_new_text();
@@ -638,6 +636,7 @@ create_advanced_settings_page(RtcomDialogContext *context)
                              G_N_ELEMENTS(keepalive_interval_items), item,
                              "keepalive-interval");
     g_object_set_data(G_OBJECT(context), BUTTON("keepalive-interval"), button);
+    set_button_baseline(button);
 
     /* discover-stun */
     init_check_button(xml, BUTTON("discover-stun"), "discover-stun", context,
@@ -646,18 +645,23 @@ create_advanced_settings_page(RtcomDialogContext *context)
     button = glade_xml_get_widget(xml, BUTTON("discover-stun"));
     g_signal_connect(button, "toggled",
                      G_CALLBACK(discover_stun_toggled_cb), context);
+    advanced_settings_add_dependent(dialog, button,
+                                    G_CALLBACK(discover_stun_toggled_cb),
+                                    context);
     discover_stun_toggled_cb(button, context);
 
-    settings = g_hash_table_new(NULL, NULL);
-    get_advanced_settings(dialog, settings);
+    PLUGIN_TRACE_BEGIN("sip:get_advanced_settings");
+    settings = advanced_settings_new(dialog);
+    PLUGIN_TRACE_END("sip:get_advanced_settings");
     g_object_set_data_full(G_OBJECT(context), "settings", settings,
-                           (GDestroyNotify)g_hash_table_destroy);
-  }
+                           (GDestroyNotify)advanced_settings_free);
 
-  g_signal_connect(dialog, "response",
-                   G_CALLBACK(on_advanced_settings_response), context);
-  g_signal_connect(dialog, "delete-event",
-                   G_CALLBACK(gtk_true), NULL);
+    g_signal_connect(dialog, "response",
+                     G_CALLBACK(on_advanced_settings_response), context);
+    g_signal_connect(dialog, "delete-event",
+                     G_CALLBACK(gtk_true), NULL);
+    PLUGIN_TRACE_END("sip:create_advanced_settings_page");
+  }
 
   return dialog;
 }
@@ -679,17 +683,31 @@ sip_plugin_context_init(RtcomAccountPlugin *plugin, RtcomDialogContext *context)
   GtkWidget *page;
   gboolean editing;
 
+  PLUGIN_TRACE_BEGIN("sip_plugin_context_init");
   editing = account_edit_context_get_editing(ACCOUNT_EDIT_CONTEXT(context));
   item = account_edit_context_get_account(ACCOUNT_EDIT_CONTEXT(context));
 
-  sa->item = item;
+  if (!priv->accounts)
+  {
+    priv->accounts = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                           NULL, sip_account_destroy);
+  }
+
+  /* the item may go before the context, but is needed to forget it */
+  sa->item = g_object_ref(item);
   sa->context = context;
-  priv->accounts = g_list_prepend(priv->accounts, sa);
+  sa->priv = priv;
 
-  g_object_add_weak_pointer(G_OBJECT(sa->context), (gpointer *)&sa->context);
+  /* an account is edited in one context at a time, a stale entry goes */
+  g_hash_table_replace(priv->accounts, item, sa);
+  g_object_weak_ref(G_OBJECT(context), sip_account_context_destroyed, sa);
   g_signal_connect(item, "store-settings",
                    G_CALLBACK(on_store_settings), sa);
-  create_advanced_settings_page(context);
+
+  if (editing)
+    plugin_ui_preload("sip-advanced.glade");
+  else
+    create_advanced_settings_page(context);
 
   if (editing)
   {
@@ -725,6 +743,7 @@ sip_plugin_context_init(RtcomAccountPlugin *plugin, RtcomDialogContext *context)
     rtcom_page_set_account(RTCOM_PAGE(page), RTCOM_ACCOUNT_ITEM(item));
 
   rtcom_dialog_context_set_start_page(context, page);
+  PLUGIN_TRACE_END("sip_plugin_context_init");
 }
 
 static void